@@ -2845,15 +2845,22 @@ static void
 emit_store_output_vs(struct v3d_compile *c, nir_intrinsic_instr *instr)
 {
         assert(c->s->info.stage == MESA_SHADER_VERTEX);
-        assert(instr->num_components == 1);
 
         uint32_t base = nir_intrinsic_base(instr);
-        struct qreg val = ntq_get_src(c, instr->src[0], 0);
 
         if (nir_src_is_const(instr->src[1])) {
-                vir_VPM_WRITE(c, val,
-                              base + nir_src_as_uint(instr->src[1]));
+                /* v3d_nir_lower_io may pack multiple components mapped to
+                 * consecutive VPM offsets in a single store_output, which we
+                 * split here into sequential VPM writes.
+                 */
+                uint32_t offset = base + nir_src_as_uint(instr->src[1]);
+                for (int i = 0; i < instr->num_components; i++) {
+                        struct qreg val = ntq_get_src(c, instr->src[0], i);
+                        vir_VPM_WRITE(c, val, offset + i);
+                }
         } else {
+                assert(instr->num_components == 1);
+                struct qreg val = ntq_get_src(c, instr->src[0], 0);
                 struct qreg offset = vir_ADD(c,
                                              ntq_get_src(c, instr->src[1], 1),
                                              vir_uniform_ui(c, base));
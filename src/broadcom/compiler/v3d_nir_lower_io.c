@@ -32,18 +32,35 @@
  * on a base representing the gallium-level vec4 driver_location to an offset
  * within the VPM, and emitting the header that's read by the fixed function
  * hardware between the VS and FS.
- *
- * We also adjust the offsets on uniform loads to be in bytes, since that's
- * what we need for indirect addressing with general TMU access.
  */
 
 struct v3d_nir_lower_io_state {
-        int pos_vpm_offset;
-        int vp_vpm_offset;
-        int zs_vpm_offset;
-        int rcp_wc_vpm_offset;
-        int psiz_vpm_offset;
-        int varyings_vpm_offset;
+        /* Per-shader invariants, hoisted out of the per-instruction walk so
+         * we don't re-dispatch on the stage key for every instruction. The
+         * fields the walk touches per intrinsic are grouped at the head of
+         * the struct so they share a cache line, with the bulky lookup
+         * table at the end.
+         */
+        gl_shader_stage stage;
+        /* Whether any VS vertex attribute needs the red/blue swizzle */
+        bool needs_va_swap;
+
+        int16_t pos_vpm_offset;
+        int16_t vp_vpm_offset;
+        int16_t zs_vpm_offset;
+        int16_t rcp_wc_vpm_offset;
+        int16_t psiz_vpm_offset;
+        int16_t varyings_vpm_offset;
+
+        uint32_t num_used_outputs;
+        struct v3d_varying_slot *used_outputs;
+
+        /* Mask of used_outputs indices the shader has stored to. A single
+         * word is enough for V3D_MAX_ANY_STAGE_INPUTS outputs.
+         */
+        uint64_t varyings_stored;
+
+        nir_def *pos[4];
 
         /* Geometry shader state */
         struct {
@@ -58,64 +75,86 @@ struct v3d_nir_lower_io_state {
                 uint32_t output_header_size;
                 /* Size of the output data for a single vertex */
                 uint32_t output_vertex_data_size;
+                /* Header value that starts a new primitive */
+                uint32_t reset_header;
         } gs;
 
-        BITSET_WORD varyings_stored[BITSET_WORDS(V3D_MAX_ANY_STAGE_INPUTS)];
-
-        nir_def *pos[4];
+        /* Maps (location, component) to an index in the stage key's
+         * used_outputs array, or -1 if the output is not consumed by the
+         * next stage.
+         */
+        int16_t slot_to_vpm[VARYING_SLOT_MAX * 4];
 };
 
 static void
-v3d_nir_emit_ff_vpm_outputs(struct v3d_compile *c, nir_builder *b,
-                            struct v3d_nir_lower_io_state *state);
-
+v3d_nir_emit_ff_vpm_outputs_gs(struct v3d_compile *c, nir_builder *b,
+                               struct v3d_nir_lower_io_state *state,
+                               nir_def *offset_reg);
+
+/* The VS stores outputs at VPM offsets known at compile time, while the GS
+ * adds a per-vertex offset computed in the shader. Callers that statically
+ * know which case applies use the specialized helpers directly; the generic
+ * wrapper dispatches on the nullability of the offset for the shared paths.
+ */
 static void
-v3d_nir_store_output(nir_builder *b, int base, nir_def *offset,
-                     nir_def *chan)
+v3d_nir_store_output_indirect(nir_builder *b, int base, nir_def *offset,
+                              nir_def *chan)
 {
-        if (offset) {
-                /* When generating the VIR instruction, the base and the offset
-                 * are just going to get added together with an ADD instruction
-                 * so we might as well do the add here at the NIR level instead
-                 * and let the constant folding do its magic.
-                 */
-                offset = nir_iadd_imm(b, offset, base);
-                base = 0;
-        } else {
-                offset = nir_imm_int(b, 0);
-        }
+        /* When generating the VIR instruction, the base and the offset
+         * are just going to get added together with an ADD instruction
+         * so we might as well do the add here at the NIR level instead
+         * and let the constant folding do its magic.
+         */
+        offset = nir_iadd_imm(b, offset, base);
 
-        nir_store_output(b, chan, offset, .base = base, .write_mask = 0x1, .component = 0);
+        nir_store_output(b, chan, offset, .base = 0,
+                         .write_mask = BITFIELD_MASK(chan->num_components),
+                         .component = 0);
 }
 
-static int
-v3d_varying_slot_vpm_offset(struct v3d_compile *c, unsigned location, unsigned component)
+static void
+v3d_nir_store_output_direct(nir_builder *b, int base, nir_def *offset_zero,
+                            nir_def *chan)
 {
-        uint32_t num_used_outputs = 0;
-        struct v3d_varying_slot *used_outputs = NULL;
-        switch (c->s->info.stage) {
-        case MESA_SHADER_VERTEX:
-                num_used_outputs = c->vs_key->num_used_outputs;
-                used_outputs = c->vs_key->used_outputs;
-                break;
-        case MESA_SHADER_GEOMETRY:
-                num_used_outputs = c->gs_key->num_used_outputs;
-                used_outputs = c->gs_key->used_outputs;
-                break;
-        default:
-                unreachable("Unsupported shader stage");
-        }
+        nir_store_output(b, chan, offset_zero, .base = base,
+                         .write_mask = BITFIELD_MASK(chan->num_components),
+                         .component = 0);
+}
 
-        for (int i = 0; i < num_used_outputs; i++) {
-                struct v3d_varying_slot slot = used_outputs[i];
+static inline void
+v3d_nir_store_output(nir_builder *b, int base, nir_def *offset,
+                     nir_def *offset_zero, nir_def *chan)
+{
+        if (offset)
+                v3d_nir_store_output_indirect(b, base, offset, chan);
+        else
+                v3d_nir_store_output_direct(b, base, offset_zero, chan);
+}
 
-                if (v3d_slot_get_slot(slot) == location &&
-                    v3d_slot_get_component(slot) == component) {
-                        return i;
-                }
+/* Builds the (location, component) -> used_outputs index table so that
+ * looking up the VPM offset for a stored component doesn't require a linear
+ * scan of the stage key's used_outputs array, which would be quadratic over
+ * the store_output instructions in the shader.
+ */
+static void
+v3d_nir_setup_slot_to_vpm(struct v3d_nir_lower_io_state *state)
+{
+        memset(state->slot_to_vpm, -1, sizeof(state->slot_to_vpm));
+
+        for (uint32_t i = 0; i < state->num_used_outputs; i++) {
+                struct v3d_varying_slot slot = state->used_outputs[i];
+                state->slot_to_vpm[v3d_slot_get_slot(slot) * 4 +
+                                   v3d_slot_get_component(slot)] = i;
         }
+}
 
-        return -1;
+static int
+v3d_varying_slot_vpm_offset(struct v3d_nir_lower_io_state *state,
+                            unsigned location, unsigned component)
+{
+        assert(location < VARYING_SLOT_MAX);
+        assert(component < 4);
+        return state->slot_to_vpm[location * 4 + component];
 }
 
 /* Lowers a store_output(gallium driver location) to a series of store_outputs
@@ -135,8 +174,10 @@ v3d_nir_lower_vpm_output(struct v3d_compile *c, nir_builder *b,
          * to the current vertex offset in the VPM.
          */
         nir_def *offset_reg =
-                c->s->info.stage == MESA_SHADER_GEOMETRY ?
+                state->stage == MESA_SHADER_GEOMETRY ?
                         nir_load_var(b, state->gs.output_offset_var) : NULL;
+        nir_def *offset_zero =
+                offset_reg ? NULL : nir_imm_int(b, 0);
 
         int start_comp = nir_intrinsic_component(intr);
         unsigned location = nir_intrinsic_io_semantics(intr).location;
@@ -153,63 +194,102 @@ v3d_nir_lower_vpm_output(struct v3d_compile *c, nir_builder *b,
         /* Just psiz to the position in the FF header right now. */
         if (location == VARYING_SLOT_PSIZ &&
             state->psiz_vpm_offset != -1) {
-                v3d_nir_store_output(b, state->psiz_vpm_offset, offset_reg, src);
+                v3d_nir_store_output(b, state->psiz_vpm_offset, offset_reg,
+                                     offset_zero, src);
         }
 
         if (location == VARYING_SLOT_LAYER) {
-                assert(c->s->info.stage == MESA_SHADER_GEOMETRY);
+                assert(state->stage == MESA_SHADER_GEOMETRY);
                 nir_def *header = nir_load_var(b, state->gs.header_var);
                 header = nir_iand_imm(b, header, 0xff00ffff);
 
-                /* From the GLES 3.2 spec:
-                 *
-                 *    "When fragments are written to a layered framebuffer, the
-                 *     fragment’s layer number selects an image from the array
-                 *     of images at each attachment (...). If the fragment’s
-                 *     layer number is negative, or greater than or equal to
-                 *     the minimum number of layers of any attachment, the
-                 *     effects of the fragment on the framebuffer contents are
-                 *     undefined."
-                 *
-                 * This suggests we can just ignore that situation, however,
-                 * for V3D an out-of-bounds layer index means that the binner
-                 * might do out-of-bounds writes access to the tile state. The
-                 * simulator has an assert to catch this, so we play safe here
-                 * and we make sure that doesn't happen by setting gl_Layer
-                 * to 0 in that case (we always allocate tile state for at
-                 * least one layer).
+                /* A constant layer 0 just clears the layer bits: we always
+                 * allocate tile state for at least one layer, so the
+                 * out-of-bounds clamp below is not needed.
                  */
-                nir_def *fb_layers = nir_load_fb_layers_v3d(b, 32);
-                nir_def *cond = nir_ige(b, src, fb_layers);
-                nir_def *layer_id =
-                        nir_bcsel(b, cond,
-                                  nir_imm_int(b, 0),
-                                  nir_ishl_imm(b, src, 16));
-                header = nir_ior(b, header, layer_id);
-                nir_store_var(b, state->gs.header_var, header, 0x1);
+                if (nir_src_is_const(intr->src[0]) &&
+                    nir_src_as_uint(intr->src[0]) == 0) {
+                        nir_store_var(b, state->gs.header_var, header, 0x1);
+                } else {
+                        /* From the GLES 3.2 spec:
+                         *
+                         *    "When fragments are written to a layered
+                         *     framebuffer, the fragment’s layer number
+                         *     selects an image from the array of images at
+                         *     each attachment (...). If the fragment’s layer
+                         *     number is negative, or greater than or equal
+                         *     to the minimum number of layers of any
+                         *     attachment, the effects of the fragment on the
+                         *     framebuffer contents are undefined."
+                         *
+                         * This suggests we can just ignore that situation,
+                         * however, for V3D an out-of-bounds layer index
+                         * means that the binner might do out-of-bounds
+                         * writes access to the tile state. The simulator has
+                         * an assert to catch this, so we play safe here and
+                         * we make sure that doesn't happen by setting
+                         * gl_Layer to 0 in that case (we always allocate
+                         * tile state for at least one layer).
+                         */
+                        nir_def *fb_layers = nir_load_fb_layers_v3d(b, 32);
+                        nir_def *cond = nir_ige(b, src, fb_layers);
+                        /* Select between the layer-cleared header and the
+                         * header with the layer merged in, so the
+                         * out-of-bounds case doesn't need a separate zero
+                         * constant and OR.
+                         */
+                        nir_def *header_with_layer =
+                                nir_ior(b, header, nir_ishl_imm(b, src, 16));
+                        header = nir_bcsel(b, cond, header, header_with_layer);
+                        nir_store_var(b, state->gs.header_var, header, 0x1);
+                }
         }
 
-        /* Scalarize outputs if it hasn't happened already, since we want to
-         * schedule each VPM write individually.  We can skip any output
-         * components not read by the FS.
+        /* We can skip any output components not read by the FS. In the VS we
+         * also keep runs of components that map to consecutive VPM offsets
+         * together in a single store_output and let nir_to_vir split them
+         * into sequential VPM writes, so the remaining NIR passes have fewer
+         * intrinsics to walk. GS stores go through the indirect offset path
+         * and stay scalar.
          */
-        for (int i = 0; i < intr->num_components; i++) {
-                int vpm_offset =
-                        v3d_varying_slot_vpm_offset(c, location, start_comp + i);
+        const unsigned wmask = nir_intrinsic_write_mask(intr);
 
-                if (!(nir_intrinsic_write_mask(intr) & (1 << i)))
+        /* Check the (cheap) write mask before looking up the VPM offset so
+         * masked-out components don't pay for the lookup at all.
+         */
+        int vpm_offset[4] = { -1, -1, -1, -1 };
+        for (int i = 0; i < intr->num_components; i++) {
+                if (!(wmask & (1 << i)))
                         continue;
 
-                if (vpm_offset == -1)
+                vpm_offset[i] =
+                        v3d_varying_slot_vpm_offset(state, location,
+                                                    start_comp + i);
+
+                if (vpm_offset[i] != -1 && nir_src_is_const(intr->src[1]))
+                        vpm_offset[i] += nir_src_as_uint(intr->src[1]) * 4;
+        }
+
+        for (int i = 0; i < intr->num_components; i++) {
+                if (vpm_offset[i] == -1)
                         continue;
 
-                if (nir_src_is_const(intr->src[1]))
-                    vpm_offset += nir_src_as_uint(intr->src[1]) * 4;
+                int run = 1;
+                if (!offset_reg) {
+                        while (i + run < intr->num_components &&
+                               vpm_offset[i + run] == vpm_offset[i] + run)
+                                run++;
+                }
+
+                for (int j = 0; j < run; j++)
+                        state->varyings_stored |= UINT64_C(1) << (vpm_offset[i] + j);
 
-                BITSET_SET(state->varyings_stored, vpm_offset);
+                v3d_nir_store_output(b,
+                                     state->varyings_vpm_offset + vpm_offset[i],
+                                     offset_reg, offset_zero,
+                                     nir_channels(b, src, BITFIELD_RANGE(i, run)));
 
-                v3d_nir_store_output(b, state->varyings_vpm_offset + vpm_offset,
-                                     offset_reg, nir_channel(b, src, i));
+                i += run - 1;
         }
 
         nir_instr_remove(&intr->instr);
@@ -218,16 +298,8 @@ v3d_nir_lower_vpm_output(struct v3d_compile *c, nir_builder *b,
 static inline void
 reset_gs_header(nir_builder *b, struct v3d_nir_lower_io_state *state)
 {
-        const uint8_t NEW_PRIMITIVE_OFFSET = 0;
-        const uint8_t VERTEX_DATA_LENGTH_OFFSET = 8;
-
-        uint32_t vertex_data_size = state->gs.output_vertex_data_size;
-        assert((vertex_data_size & 0xffffff00) == 0);
-
-        uint32_t header;
-        header  = 1 << NEW_PRIMITIVE_OFFSET;
-        header |= vertex_data_size << VERTEX_DATA_LENGTH_OFFSET;
-        nir_store_var(b, state->gs.header_var, nir_imm_int(b, header), 0x1);
+        nir_store_var(b, state->gs.header_var,
+                      nir_imm_int(b, state->gs.reset_header), 0x1);
 }
 
 static void
@@ -241,11 +313,11 @@ v3d_nir_lower_emit_vertex(struct v3d_compile *c, nir_builder *b,
         nir_def *header_offset = nir_load_var(b, state->gs.header_offset_var);
         nir_def *output_offset = nir_load_var(b, state->gs.output_offset_var);
 
-        /* Emit fixed function outputs */
-        v3d_nir_emit_ff_vpm_outputs(c, b, state);
+        /* Emit fixed function outputs at the current vertex offset */
+        v3d_nir_emit_ff_vpm_outputs_gs(c, b, state, output_offset);
 
         /* Emit vertex header */
-        v3d_nir_store_output(b, 0, header_offset, header);
+        v3d_nir_store_output_indirect(b, 0, header_offset, header);
 
         /* Update VPM offset for next vertex output data and header */
         output_offset =
@@ -288,9 +360,7 @@ v3d_nir_lower_vertex_input(struct v3d_compile *c, nir_builder *b,
                            nir_intrinsic_instr *instr)
 {
         assert(c->s->info.stage == MESA_SHADER_VERTEX);
-
-        if (!c->vs_key->va_swap_rb_mask)
-                return;
+        assert(c->vs_key->va_swap_rb_mask);
 
         const uint32_t location = nir_intrinsic_io_semantics(instr).location;
 
@@ -303,24 +373,20 @@ v3d_nir_lower_vertex_input(struct v3d_compile *c, nir_builder *b,
                 nir_intrinsic_set_component(instr, (comp + 2) % 4);
 }
 
-static void
-v3d_nir_lower_io_instr(struct v3d_compile *c, nir_builder *b,
-                       struct nir_instr *instr,
-                       struct v3d_nir_lower_io_state *state)
+static inline void
+v3d_nir_lower_io_intrinsic(struct v3d_compile *c, nir_builder *b,
+                           nir_intrinsic_instr *intr,
+                           struct v3d_nir_lower_io_state *state)
 {
-        if (instr->type != nir_instr_type_intrinsic)
-                return;
-        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
-
         switch (intr->intrinsic) {
         case nir_intrinsic_load_input:
-                if (c->s->info.stage == MESA_SHADER_VERTEX)
+                if (state->needs_va_swap)
                         v3d_nir_lower_vertex_input(c, b, intr);
                 break;
 
         case nir_intrinsic_store_output:
-                if (c->s->info.stage == MESA_SHADER_VERTEX ||
-                    c->s->info.stage == MESA_SHADER_GEOMETRY) {
+                if (state->stage == MESA_SHADER_VERTEX ||
+                    state->stage == MESA_SHADER_GEOMETRY) {
                         v3d_nir_lower_vpm_output(c, b, intr, state);
                 }
                 break;
@@ -346,21 +412,22 @@ v3d_nir_lower_io_update_output_var_base(struct v3d_compile *c,
                                         struct v3d_nir_lower_io_state *state)
 {
         nir_foreach_shader_out_variable_safe(var, c->s) {
-                if (var->data.location == VARYING_SLOT_POS &&
+                const unsigned location = var->data.location;
+
+                if (location == VARYING_SLOT_POS &&
                     state->pos_vpm_offset != -1) {
                         var->data.driver_location = state->pos_vpm_offset;
                         continue;
                 }
 
-                if (var->data.location == VARYING_SLOT_PSIZ &&
+                if (location == VARYING_SLOT_PSIZ &&
                     state->psiz_vpm_offset != -1) {
                         var->data.driver_location = state->psiz_vpm_offset;
                         continue;
                 }
 
-                int vpm_offset =
-                        v3d_varying_slot_vpm_offset(c,
-                                                    var->data.location,
+                const int vpm_offset =
+                        v3d_varying_slot_vpm_offset(state, location,
                                                     var->data.location_frac);
                 if (vpm_offset != -1) {
                         var->data.driver_location =
@@ -463,47 +530,80 @@ v3d_nir_setup_vpm_layout_gs(struct v3d_compile *c,
         state->gs.output_vertex_data_size =
                 state->varyings_vpm_offset + c->gs_key->num_used_outputs;
 
+        /* The header that starts a new primitive has the New Primitive bit
+         * set and the vertex data length in bits 8..15; it is a per-shader
+         * constant so compute it once here.
+         */
+        const uint8_t NEW_PRIMITIVE_OFFSET = 0;
+        const uint8_t VERTEX_DATA_LENGTH_OFFSET = 8;
+        assert((state->gs.output_vertex_data_size & 0xffffff00) == 0);
+        state->gs.reset_header =
+                (1 << NEW_PRIMITIVE_OFFSET) |
+                (state->gs.output_vertex_data_size << VERTEX_DATA_LENGTH_OFFSET);
+
         c->vpm_output_size =
                 state->gs.output_header_size +
                 state->gs.output_vertex_data_size * num_vertices;
 }
 
-static void
+/* Emits the fixed function outputs to the VPM. For the GS the caller passes
+ * the current vertex offset in offset_reg (which it has already loaded for
+ * its own use); for the VS offset_reg is NULL.
+ *
+ * Force-inlined into the per-stage wrappers below so the compiler folds the
+ * offset_reg nullability checks away in each specialization. The remaining
+ * conditions depend on the VPM layout of the particular shader key, so they
+ * stay runtime checks.
+ */
+static ALWAYS_INLINE void
 v3d_nir_emit_ff_vpm_outputs(struct v3d_compile *c, nir_builder *b,
-                            struct v3d_nir_lower_io_state *state)
+                            struct v3d_nir_lower_io_state *state,
+                            nir_def *offset_reg)
 {
-        /* If this is a geometry shader we need to emit our fixed function
-         * outputs to the current vertex offset in the VPM.
-         */
-        nir_def *offset_reg =
-                c->s->info.stage == MESA_SHADER_GEOMETRY ?
-                        nir_load_var(b, state->gs.output_offset_var) : NULL;
+        nir_def *offset_zero =
+                offset_reg ? NULL : nir_imm_int(b, 0);
 
+        nir_def *undef = NULL;
         for (int i = 0; i < 4; i++) {
-                if (!state->pos[i])
-                        state->pos[i] = nir_undef(b, 1, 32);
+                if (!state->pos[i]) {
+                        if (!undef)
+                                undef = nir_undef(b, 1, 32);
+                        state->pos[i] = undef;
+                }
         }
 
-        nir_def *rcp_wc = nir_frcp(b, state->pos[3]);
+        /* The perspective divide is only needed for the viewport-transformed
+         * and Z outputs, so don't emit the (multi-instruction) reciprocal
+         * when none of them is part of the VPM layout.
+         */
+        const bool need_rcp_wc = state->vp_vpm_offset != -1 ||
+                                 state->zs_vpm_offset != -1 ||
+                                 state->rcp_wc_vpm_offset != -1;
+        nir_def *rcp_wc =
+                need_rcp_wc ? nir_frcp(b, state->pos[3]) : NULL;
 
         if (state->pos_vpm_offset != -1) {
                 for (int i = 0; i < 4; i++) {
                         v3d_nir_store_output(b, state->pos_vpm_offset + i,
-                                             offset_reg, state->pos[i]);
+                                             offset_reg, offset_zero,
+                                             state->pos[i]);
                 }
         }
 
         if (state->vp_vpm_offset != -1) {
+                nir_def *vp_scale[2] = {
+                        nir_load_viewport_x_scale(b),
+                        nir_load_viewport_y_scale(b),
+                };
                 for (int i = 0; i < 2; i++) {
-                        nir_def *pos;
-                        nir_def *scale;
-                        pos = state->pos[i];
-                        if (i == 0)
-                                scale = nir_load_viewport_x_scale(b);
-                        else
-                                scale = nir_load_viewport_y_scale(b);
-                        pos = nir_fmul(b, pos, scale);
-                        pos = nir_fmul(b, pos, rcp_wc);
+                        /* Fold the viewport scale and the perspective divide
+                         * into one combined factor and apply it to the
+                         * coordinate with a single multiply.
+                         */
+                        nir_def *scale_rcp_wc =
+                                nir_fmul(b, vp_scale[i], rcp_wc);
+                        nir_def *pos =
+                                nir_fmul(b, state->pos[i], scale_rcp_wc);
                         /* Pre-V3D 4.3 hardware has a quirk where it expects XY
                          * coordinates in .8 fixed-point format, but then it
                          * will internally round it to .6 fixed-point,
@@ -521,7 +621,7 @@ v3d_nir_emit_ff_vpm_outputs(struct v3d_compile *c, nir_builder *b,
                                  pos = nir_f2i32(b, nir_fround_even(b, pos));
 
                        v3d_nir_store_output(b, state->vp_vpm_offset + i,
-                                            offset_reg, pos);
+                                            offset_reg, offset_zero, pos);
                 }
         }
 
@@ -530,38 +630,66 @@ v3d_nir_emit_ff_vpm_outputs(struct v3d_compile *c, nir_builder *b,
                 z = nir_fmul(b, z, nir_load_viewport_z_scale(b));
                 z = nir_fmul(b, z, rcp_wc);
                 z = nir_fadd(b, z, nir_load_viewport_z_offset(b));
-                v3d_nir_store_output(b, state->zs_vpm_offset, offset_reg, z);
+                v3d_nir_store_output(b, state->zs_vpm_offset, offset_reg,
+                                     offset_zero, z);
         }
 
         if (state->rcp_wc_vpm_offset != -1) {
                 v3d_nir_store_output(b, state->rcp_wc_vpm_offset,
-                                     offset_reg, rcp_wc);
+                                     offset_reg, offset_zero, rcp_wc);
         }
 
         /* Store 0 to varyings requested by the FS but not stored by the
          * previous stage. This should be undefined behavior, but
          * glsl-routing seems to rely on it.
          */
-        uint32_t num_used_outputs;
-        switch (c->s->info.stage) {
-        case MESA_SHADER_VERTEX:
-                num_used_outputs = c->vs_key->num_used_outputs;
-                break;
-        case MESA_SHADER_GEOMETRY:
-                num_used_outputs = c->gs_key->num_used_outputs;
-                break;
-        default:
-                unreachable("Unsupported shader stage");
-        }
+        uint64_t missing = ~state->varyings_stored &
+                u_bit_consecutive64(0, state->num_used_outputs);
+        nir_def *zero = NULL;
+        while (missing) {
+                int i = u_bit_scan64(&missing);
+
+                /* In the VS, runs of up to 4 consecutive missing outputs can
+                 * be cleared with a single vector store.
+                 */
+                int run = 1;
+                if (!offset_reg) {
+                        while (run < 4 && i + run < 64 &&
+                               (missing & (UINT64_C(1) << (i + run)))) {
+                                missing &= ~(UINT64_C(1) << (i + run));
+                                run++;
+                        }
+                }
 
-        for (int i = 0; i < num_used_outputs; i++) {
-                if (!BITSET_TEST(state->varyings_stored, i)) {
+                if (run > 1) {
+                        v3d_nir_store_output_direct(b,
+                                                    state->varyings_vpm_offset + i,
+                                                    offset_zero,
+                                                    nir_imm_zero(b, run, 32));
+                } else {
+                        if (!zero)
+                                zero = nir_imm_int(b, 0);
                         v3d_nir_store_output(b, state->varyings_vpm_offset + i,
-                                             offset_reg, nir_imm_int(b, 0));
+                                             offset_reg, offset_zero, zero);
                 }
         }
 }
 
+static void
+v3d_nir_emit_ff_vpm_outputs_vs(struct v3d_compile *c, nir_builder *b,
+                               struct v3d_nir_lower_io_state *state)
+{
+        v3d_nir_emit_ff_vpm_outputs(c, b, state, NULL);
+}
+
+static void
+v3d_nir_emit_ff_vpm_outputs_gs(struct v3d_compile *c, nir_builder *b,
+                               struct v3d_nir_lower_io_state *state,
+                               nir_def *offset_reg)
+{
+        v3d_nir_emit_ff_vpm_outputs(c, b, state, offset_reg);
+}
+
 static void
 emit_gs_prolog(struct v3d_compile *c, nir_builder *b,
                nir_function_impl *impl,
@@ -612,7 +740,7 @@ emit_gs_vpm_output_header_prolog(struct v3d_compile *c, nir_builder *b,
                                          VERTEX_COUNT_OFFSET),
                             state->gs.output_header_size);
 
-        v3d_nir_store_output(b, 0, NULL, header);
+        v3d_nir_store_output_direct(b, 0, nir_imm_int(b, 0), header);
 }
 
 bool
@@ -620,16 +748,36 @@ v3d_nir_lower_io(nir_shader *s, struct v3d_compile *c)
 {
         struct v3d_nir_lower_io_state state = { 0 };
 
+        /* The varyings_stored mask is a single 64-bit word */
+        STATIC_ASSERT(V3D_MAX_ANY_STAGE_INPUTS <= 64);
+        /* Keep the fields touched per intrinsic within two cache lines */
+        STATIC_ASSERT(offsetof(struct v3d_nir_lower_io_state, gs) <= 128);
+
+        /* Only VS and GS have IO to lower here: don't walk the instructions
+         * of fragment and compute shaders at all.
+         */
+        if (s->info.stage == MESA_SHADER_FRAGMENT ||
+            s->info.stage == MESA_SHADER_COMPUTE) {
+                nir_shader_preserve_all_metadata(s);
+                return false;
+        }
+
+        state.stage = s->info.stage;
+
         /* Set up the layout of the VPM outputs. */
         switch (s->info.stage) {
         case MESA_SHADER_VERTEX:
+                state.num_used_outputs = c->vs_key->num_used_outputs;
+                state.used_outputs = c->vs_key->used_outputs;
+                state.needs_va_swap = c->vs_key->va_swap_rb_mask != 0;
                 v3d_nir_setup_vpm_layout_vs(c, &state);
+                v3d_nir_setup_slot_to_vpm(&state);
                 break;
         case MESA_SHADER_GEOMETRY:
+                state.num_used_outputs = c->gs_key->num_used_outputs;
+                state.used_outputs = c->gs_key->used_outputs;
                 v3d_nir_setup_vpm_layout_gs(c, &state);
-                break;
-        case MESA_SHADER_FRAGMENT:
-        case MESA_SHADER_COMPUTE:
+                v3d_nir_setup_slot_to_vpm(&state);
                 break;
         default:
                 unreachable("Unsupported shader stage");
@@ -638,19 +786,23 @@ v3d_nir_lower_io(nir_shader *s, struct v3d_compile *c)
         nir_foreach_function_impl(impl, s) {
                 nir_builder b = nir_builder_create(impl);
 
-                if (c->s->info.stage == MESA_SHADER_GEOMETRY)
+                if (state.stage == MESA_SHADER_GEOMETRY)
                         emit_gs_prolog(c, &b, impl, &state);
 
                 nir_foreach_block(block, impl) {
-                        nir_foreach_instr_safe(instr, block)
-                                v3d_nir_lower_io_instr(c, &b, instr,
-                                                       &state);
+                        nir_foreach_instr_safe(instr, block) {
+                                if (instr->type != nir_instr_type_intrinsic)
+                                        continue;
+                                v3d_nir_lower_io_intrinsic(c, &b,
+                                                           nir_instr_as_intrinsic(instr),
+                                                           &state);
+                        }
                 }
 
                 nir_block *last = nir_impl_last_block(impl);
                 b.cursor = nir_after_block(last);
                 if (s->info.stage == MESA_SHADER_VERTEX) {
-                        v3d_nir_emit_ff_vpm_outputs(c, &b, &state);
+                        v3d_nir_emit_ff_vpm_outputs_vs(c, &b, &state);
                 } else if (s->info.stage == MESA_SHADER_GEOMETRY) {
                         emit_gs_vpm_output_header_prolog(c, &b, &state);
                 }
@@ -660,10 +812,7 @@ v3d_nir_lower_io(nir_shader *s, struct v3d_compile *c)
                                       nir_metadata_dominance);
         }
 
-        if (s->info.stage == MESA_SHADER_VERTEX ||
-            s->info.stage == MESA_SHADER_GEOMETRY) {
-                v3d_nir_lower_io_update_output_var_base(c, &state);
-        }
+        v3d_nir_lower_io_update_output_var_base(c, &state);
 
         /* It is really unlikely that we don't get progress here, and fully
          * filtering when not would make code more complex, but we are still